@@ -4,19 +4,22 @@
 #include <iostream>
 #include <typeinfo>
 #include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
 
 #include "timer.h"
 #include "mymacros.h"
 #include "sse.h"
+#include "instrument.h"
+#include "shm_ring.h"
 
 typedef unsigned char byte;
 
 static const size_t NUM_TIMESLOTS = 32;
 static const size_t DST_SIZE = 64;
 static const size_t SRC_SIZE = NUM_TIMESLOTS * DST_SIZE;
-static const size_t MIN_COUNT = 1;
-static const size_t MAX_COUNT = 1024 * 1024;
-static const unsigned ITERATIONS = 1024 * 1024;
 
 using namespace std;
 
@@ -255,18 +258,191 @@ public:
     }
 };
 
+/** Transpose of a large window: any number of frames (src_length / NUM_TIMESLOTS),
+  * each channel goes to one contiguous array dst [channel] of that many bytes.
+  * The window is processed in strips of STRIP_FRAMES frames (a whole cache line of every channel),
+  * each strip in groups of GROUP_CHANNELS channels, which are transposed in AVX registers, 32 frames at a time.
+  * Unlike Tiled kernels, the channel arrays need not be aligned, and frames beyond the last whole strip
+  * are copied one by one.
+  */
+class Transpose_Window : public Demux
+{
+public:
+    void demux (const byte * src, size_t src_length, byte ** dst) const
+    {
+        assert (src_length % NUM_TIMESLOTS == 0);
+        assert (NUM_TIMESLOTS % GROUP_CHANNELS == 0);
+
+        size_t frames = src_length / NUM_TIMESLOTS;
+        size_t tiled = frames / STRIP_FRAMES * STRIP_FRAMES;
+        bool aligned = true;
+        for (size_t dst_num = 0; dst_num < NUM_TIMESLOTS; ++ dst_num) {
+            aligned &= ((size_t) dst [dst_num] & 31) == 0;
+        }
+        if (aligned) {
+            strips<true> (src, dst, tiled);
+        } else {
+            strips<false> (src, dst, tiled);
+        }
+        for (size_t frame = tiled; frame < frames; ++ frame) {
+            for (size_t dst_num = 0; dst_num < NUM_TIMESLOTS; ++ dst_num) {
+                dst [dst_num][frame] = src [frame * NUM_TIMESLOTS + dst_num];
+            }
+        }
+    }
+
+private:
+    static const size_t STRIP_FRAMES = 64;
+    static const size_t GROUP_CHANNELS = 8;
+
+    /** Transposes the first 'frames' frames, a multiple of STRIP_FRAMES
+      * @param aligned whether all channel arrays are 32-byte aligned
+      */
+    template<bool aligned> static void strips (const byte * src, byte ** dst, size_t frames)
+    {
+        for (size_t frame = 0; frame < frames; frame += STRIP_FRAMES) {
+            for (size_t dst_num = 0; dst_num < NUM_TIMESLOTS; dst_num += GROUP_CHANNELS) {
+                byte * d [GROUP_CHANNELS];
+                for (size_t k = 0; k < GROUP_CHANNELS; k++) {
+                    d [k] = dst [dst_num + k] + frame;
+                }
+                const byte * p = src + frame * NUM_TIMESLOTS + dst_num;
+                tile<aligned> (p, d, 0);
+                tile<aligned> (p, d, 32);
+            }
+        }
+    }
+
+    /** Reads 8 bytes from each of 4 consecutive frames and transposes them into two 4x4 matrices
+      * @param p  pointer to the first byte in the first frame
+      * @param m0 receives 4 bytes of channels 0..3 in frame order, channel after channel
+      * @param m1 receives 4 bytes of channels 4..7 in frame order, channel after channel
+      */
+    static inline void load_4x8 (const byte * p, __m128i & m0, __m128i & m1)
+    {
+        __m128i x0 = _mm_unpacklo_epi64 (_mm_loadl_epi64 ((const __m128i *) (p + 0 * NUM_TIMESLOTS)),
+                                         _mm_loadl_epi64 ((const __m128i *) (p + 1 * NUM_TIMESLOTS)));
+        __m128i x1 = _mm_unpacklo_epi64 (_mm_loadl_epi64 ((const __m128i *) (p + 2 * NUM_TIMESLOTS)),
+                                         _mm_loadl_epi64 ((const __m128i *) (p + 3 * NUM_TIMESLOTS)));
+        m0 = transpose_4x4 (_128i_shuffle (x0, x1, 0, 2, 0, 2));
+        m1 = transpose_4x4 (_128i_shuffle (x0, x1, 1, 3, 1, 3));
+    }
+
+    /** Stores 32 bytes, with an aligned store if possible (GCC splits unaligned 256-bit stores in two)
+      */
+    template<bool aligned> static inline void store (byte * p, __m256i x)
+    {
+        if (aligned) {
+            _256i_store (p, x);
+        } else {
+            _256i_storeu (p, x);
+        }
+    }
+
+    /** Transposes a 32 frames x 8 channels tile, the same way as MOVE256 in Read8_Write32_AVX_Unroll
+      * @param src   pointer to the first channel of the group in the first frame of the strip
+      * @param d     pointers to the strip in the channel arrays of the group
+      * @param frame offset of the tile in the strip
+      */
+    template<bool aligned> static inline void tile (const byte * src, byte * const * d, size_t frame)
+    {
+        const byte * p = src + frame * NUM_TIMESLOTS;
+
+        __m128i a0, a1, a2, a3, b0, b1, b2, b3;
+        load_4x8 (p + 0 * NUM_TIMESLOTS, a0, b0);
+        load_4x8 (p + 4 * NUM_TIMESLOTS, a1, b1);
+        load_4x8 (p + 8 * NUM_TIMESLOTS, a2, b2);
+        load_4x8 (p + 12 * NUM_TIMESLOTS, a3, b3);
+
+        __m128i c0, c1, c2, c3, e0, e1, e2, e3;
+        load_4x8 (p + 16 * NUM_TIMESLOTS, c0, e0);
+        load_4x8 (p + 20 * NUM_TIMESLOTS, c1, e1);
+        load_4x8 (p + 24 * NUM_TIMESLOTS, c2, e2);
+        load_4x8 (p + 28 * NUM_TIMESLOTS, c3, e3);
+
+        __m256i w0 = _256i_combine_lo_hi (a0, c0);
+        __m256i w1 = _256i_combine_lo_hi (a1, c1);
+        __m256i w2 = _256i_combine_lo_hi (a2, c2);
+        __m256i w3 = _256i_combine_lo_hi (a3, c3);
+        __m256i w4 = _256i_combine_lo_hi (b0, e0);
+        __m256i w5 = _256i_combine_lo_hi (b1, e1);
+        __m256i w6 = _256i_combine_lo_hi (b2, e2);
+        __m256i w7 = _256i_combine_lo_hi (b3, e3);
+
+        transpose_avx_4x4_dwords (w0, w1, w2, w3);
+        store<aligned> (d [0] + frame, w0);
+        store<aligned> (d [1] + frame, w1);
+        store<aligned> (d [2] + frame, w2);
+        store<aligned> (d [3] + frame, w3);
+
+        transpose_avx_4x4_dwords (w4, w5, w6, w7);
+        store<aligned> (d [4] + frame, w4);
+        store<aligned> (d [5] + frame, w5);
+        store<aligned> (d [6] + frame, w6);
+        store<aligned> (d [7] + frame, w7);
+    }
+};
+
+/** Applies a small-block kernel D to a large window, one NUM_TIMESLOTS x DST_SIZE tile at a time,
+  * writing every tile into its place in the per-channel arrays. The window must be a whole number of tiles.
+  */
+template<class D> class Tiled : public D
+{
+public:
+    void demux (const byte * src, size_t src_length, byte ** dst) const
+    {
+        assert (src_length % SRC_SIZE == 0);
+
+        byte * d [NUM_TIMESLOTS];
+        for (size_t pos = 0; pos < src_length / NUM_TIMESLOTS; pos += DST_SIZE) {
+            for (size_t dst_num = 0; dst_num < NUM_TIMESLOTS; ++ dst_num) {
+                d [dst_num] = dst [dst_num] + pos;
+            }
+            D::demux (src + pos * NUM_TIMESLOTS, SRC_SIZE, d);
+        }
+    }
+};
+
+/** A wrapper that adds hot-path instrumentation (see instrument.h) to any demux class.
+  * The call to the wrapped class is not virtual, so it is inlined as usual; when E1_INSTRUMENT
+  * is not defined, this class is identical to D.
+  */
+template<class D> class Instrumented : public D
+{
+public:
+    void demux (const byte * src, size_t src_length, byte ** dst) const
+    {
+        uint64_t t0 = instr_begin ();
+        D::demux (src, src_length, dst);
+        instr_end (t0, src_length);
+    }
+};
+
+/** Allocates memory for the benchmark buffers, exits with a message if there is not enough
+  */
+void * allocate (size_t size)
+{
+    void * buf = _mm_malloc(size, 32);
+    if (! buf) {
+        fprintf(stderr, "Can't allocate %zu bytes (%zu MB); use a smaller sweep end (-e) or window (-w)\n",
+                size, size / (1024 * 1024));
+        exit (1);
+    }
+    return buf;
+}
+
 byte * generate (size_t count)
 {
-    byte * buf = (byte*)_mm_malloc(SRC_SIZE * count, 32);
+    byte * buf = (byte*)allocate(SRC_SIZE * count);
     memset(buf, (byte) 0xEE, SRC_SIZE * count);
     return buf;
 }
 
 byte ** allocate_dst(size_t count)
 {
-    byte * buf = (byte*)_mm_malloc(SRC_SIZE * count, 32);
+    byte * buf = (byte*)allocate(SRC_SIZE * count);
     memset (buf, 0xDD, SRC_SIZE * count);
-    byte ** result = new byte *[NUM_TIMESLOTS * count];
+    byte ** result = (byte **)allocate(NUM_TIMESLOTS * count * sizeof (byte *));
     for (size_t i = 0; i < NUM_TIMESLOTS * count; i++) {
         result[i] = buf + i * DST_SIZE;
     }
@@ -275,135 +451,736 @@ byte ** allocate_dst(size_t count)
 
 byte * src;
 byte ** dst;
+unsigned * rnd_raw;  // random numbers, generated once
+unsigned * rnd;      // rnd_raw reduced to the current number of blocks, outside of the timed loop
 
-void measure_base (const Demux & demux)
+/** Access modes of the benchmark. Each mode defines which source block and which destination
+  * block the j-th call of a pass over count blocks works on.
+  */
+enum Mode
 {
-    printf("      %-30s:", typeid (demux).name());
-    fflush(stdout);
-    unsigned iterations = ITERATIONS;
-    int64_t tfirst;
-
-    for (unsigned count = MIN_COUNT; count <= MAX_COUNT; count *= 2) {
-        uint64_t t0 = currentTimeMillis();
-        for (unsigned i = 0; i < iterations; i++) {
-            for (unsigned j = 0; j < count; j++) {
-                demux.demux(src + SRC_SIZE * j, SRC_SIZE, dst + NUM_TIMESLOTS * j);
-            }
+    BASE,       // src j, dst j: both sequential
+    RAND,       // src p, dst p: the same random block in both
+    READ_MISS,  // src j, dst 0: only source misses the cache as count grows
+    WRITE_MISS, // src 0, dst j: only destination misses the cache as count grows
+    MIXED,      // src j, dst p: sequential source, independent random destination
+    NUM_MODES
+};
+
+static const char * const MODE_NAMES [NUM_MODES] = {"base", "rand", "read", "write", "mixed"};
+
+template<Mode mode> inline size_t src_index (size_t j)
+{
+    switch (mode) {
+    case RAND: return rnd [j];
+    case WRITE_MISS: return 0;
+    default: return j;
+    }
+}
+
+template<Mode mode> inline size_t dst_index (size_t j)
+{
+    switch (mode) {
+    case RAND: case MIXED: return rnd [j];
+    case READ_MISS: return 0;
+    default: return j;
+    }
+}
+
+/** Run a number of passes of the demux over count blocks
+  */
+template<Mode mode> void run_passes (const Demux & demux, size_t count, unsigned passes)
+{
+    for (unsigned i = 0; i < passes; i++) {
+        for (size_t j = 0; j < count; j++) {
+            demux.demux(src + SRC_SIZE * src_index<mode> (j), SRC_SIZE,
+                        dst + NUM_TIMESLOTS * dst_index<mode> (j));
         }
-        int64_t t = (int64_t)(currentTimeMillis() - t0);
-        if (count == MIN_COUNT) {
-            tfirst = t;
+    }
+}
+
+void run_passes (Mode mode, const Demux & demux, size_t count, unsigned passes)
+{
+    switch (mode) {
+    case BASE: run_passes<BASE> (demux, count, passes); break;
+    case RAND: run_passes<RAND> (demux, count, passes); break;
+    case READ_MISS: run_passes<READ_MISS> (demux, count, passes); break;
+    case WRITE_MISS: run_passes<WRITE_MISS> (demux, count, passes); break;
+    case MIXED: run_passes<MIXED> (demux, count, passes); break;
+    default: assert (false);
+    }
+}
+
+static const size_t MAX_KERNELS = 16;
+static const size_t MAX_POINTS = 32;
+
+/** Benchmark parameters, set from the command line
+  */
+struct Config
+{
+    size_t min_count;
+    size_t max_count;
+    size_t step;         // a multiplier, or an increment if step_add is set
+    bool step_add;
+    unsigned budget_ms;  // time to spend on each point of the sweep
+    bool modes [NUM_MODES];
+    bool kernels [MAX_KERNELS]; // selected entries of the kernel table of the chosen benchmark
+    size_t fanout [MAX_POINTS]; // reader counts for the shared-memory fan-out benchmark
+    size_t num_fanout;   // 0 unless the fan-out benchmark is chosen
+    unsigned ring_slots;
+    size_t windows [MAX_POINTS]; // frame counts for the large-window benchmark
+    size_t num_windows;  // 0 unless the large-window benchmark is chosen
+
+    Config () : min_count (1), max_count (1024 * 1024), step (2), step_add (false), budget_ms (100),
+                num_fanout (0), ring_slots (256), num_windows (0)
+    {
+        memset (modes, 0, sizeof (modes));
+        memset (kernels, 0, sizeof (kernels));
+    }
+
+    size_t next (size_t count) const
+    {
+        return step_add ? count + step : count * step;
+    }
+};
+
+/** Measure one kernel in one mode over the whole sweep. Prints one line of average times
+  * per source block, in nanoseconds.
+  * At each point, passes are repeated in growing batches until the time budget is spent.
+  */
+void measure (Mode mode, const char * name, const Demux & demux, const Config & config)
+{
+    printf("%-5s %-32s:", MODE_NAMES [mode], name);
+    fflush(stdout);
+    uint64_t budget = (uint64_t) config.budget_ms * 1000000;
+
+    for (size_t count = config.min_count; count <= config.max_count; count = config.next (count)) {
+        for (size_t j = 0; j < count; j++) {
+            rnd [j] = rnd_raw [j] % count;
         }
-        else {
-            t -= tfirst;
+        run_passes (mode, demux, count, 1);
+
+        uint64_t elapsed = 0;
+        uint64_t total_passes = 0;
+        unsigned passes = 1;
+        while (elapsed < budget) {
+            uint64_t t0 = currentTimeNanos();
+            run_passes (mode, demux, count, passes);
+            uint64_t t = currentTimeNanos() - t0;
+            elapsed += t;
+            total_passes += passes;
+            if (t < budget / 8) passes *= 2;
         }
-        printf("%5d", t);
+        printf(" %6.1f", (double) elapsed / (total_passes * count));
         fflush(stdout);
-        iterations /= 2;
     }
     cout << endl;
 }
 
-void measure_read_uncached (const Demux & demux)
+/** Number of numbered source blocks the fan-out writer cycles over. Write n uses block n % pool and goes
+  * to slot n % ring_slots. The pool is a prime of at most 256 that does not divide ring_slots, so every
+  * block has its own byte value, and the next occupant of a slot, and all the following ones up to
+  * pool writers' laps later, hold a different block than the current one.
+  */
+size_t fanout_pool (unsigned ring_slots)
 {
-    printf(" read-%-30s:", typeid (demux).name());
-    fflush(stdout);
-    unsigned iterations = ITERATIONS;
-    int64_t tfirst;
-
-    for (unsigned count = MIN_COUNT; count <= MAX_COUNT; count *= 2) {
-        uint64_t t0 = currentTimeMillis();
-        for (unsigned i = 0; i < iterations; i++) {
-            for (unsigned j = 0; j < count; j++) {
-                demux.demux(src + SRC_SIZE * j, SRC_SIZE, dst);
-            }
+    // their product does not fit in unsigned, so one of them does not divide ring_slots
+    static const size_t PRIMES [] = {251, 241, 239, 233, 229};
+    size_t i = 0;
+    while (ring_slots % PRIMES [i] == 0) ++ i;
+    return PRIMES [i];
+}
+
+/** Allocates source blocks for the fan-out benchmark; every byte of block k is (byte) k,
+  * so that a reader can tell which block a slot holds, whatever kernel demuxed it
+  */
+byte * generate_numbered (size_t count)
+{
+    byte * buf = (byte*)allocate(SRC_SIZE * count);
+    for (size_t k = 0; k < count; k++) {
+        memset(buf + SRC_SIZE * k, (byte) k, SRC_SIZE);
+    }
+    return buf;
+}
+
+/** Consumer of the fan-out benchmark: reads every byte of every channel of a slot
+  * @param expected the value all bytes must have
+  * @return true if all bytes are equal to the expected value
+  */
+bool consume (const byte * const * channels, byte expected)
+{
+    uint64_t pattern = expected * 0x0101010101010101ULL;
+    uint64_t diff = 0;
+    for (size_t c = 0; c < NUM_TIMESLOTS; c++) {
+        const uint64_t * p = (const uint64_t *) channels [c];
+        for (size_t i = 0; i < DST_SIZE / 8; i++) {
+            diff |= p [i] ^ pattern;
         }
-        int64_t t = (int64_t)(currentTimeMillis() - t0);
-        if (count == MIN_COUNT) {
-            tfirst = t;
+    }
+    return diff == 0;
+}
+
+/** Reader process of the fan-out benchmark: consumes slots in place until the writer finishes.
+  * Slot n must hold source block n % pool; slots that end_read() reports intact but that hold
+  * anything else are counted in *mismatches.
+  */
+void fanout_reader (Shm_Ring & ring, unsigned r, size_t pool, uint64_t * mismatches)
+{
+    while (! ring.finished ()) {
+        const byte * const * channels = ring.begin_read (r);
+        if (! channels) {
+            _mm_pause ();
+            continue;
         }
-        else {
-            t -= tfirst;
+        uint64_t pos = ring.reader_info (r).pos;
+        bool ok = consume (channels, (byte) (pos % pool));
+        if (ring.end_read (r) && ! ok) {
+            ++ *mismatches;
         }
-        printf("%5d", t);
-        fflush(stdout);
-        iterations /= 2;
     }
-    cout << endl;
+    ring.detach_reader (r);
+}
+
+/** Reader process of the fan-out benchmark: opens the ring by name, as an unrelated process would,
+  * and claims a reader record of its own
+  */
+void fanout_reader_process (const char * ring_name, size_t pool, uint64_t * mismatches)
+{
+    Shm_Ring ring (ring_name);
+    if (! ring.valid ()) {
+        perror (ring_name);
+        _exit (1);
+    }
+    int r = ring.claim_reader ();
+    if (r < 0) {
+        fprintf(stderr, "%s: no free reader record\n", ring_name);
+        _exit (1);
+    }
+    fanout_reader (ring, r, pool, mismatches + r * (RING_LINE / sizeof (uint64_t)));
+    _exit (0);
 }
 
-void measure_write_uncached (const Demux & demux)
+/** Stops and reaps the readers started so far
+  */
+void stop_readers (Shm_Ring & ring, const pid_t * pids, unsigned readers)
 {
-    printf("write-%-30s:", typeid (demux).name());
+    ring.finish ();
+    for (unsigned r = 0; r < readers; r++) {
+        waitpid (pids [r], 0, 0);
+    }
+}
+
+/** Waits until all readers have claimed their records, so that they all see the whole run
+  * @return false if a reader exited before that
+  */
+bool wait_for_readers (Shm_Ring & ring, unsigned readers)
+{
+    while (ring.active_readers () < readers) {
+        if (waitpid (-1, 0, WNOHANG) > 0) return false;
+        usleep (1000);
+    }
+    return true;
+}
+
+/** Measure the writer throughput of demuxing into a shared-memory ring read by a growing number
+  * of reader processes. Prints one line of average writer times per block, in nanoseconds, followed by
+  * the percentage of slots the readers lost because the writer overran them, the largest number of
+  * readers seen lagging by more than half the ring during the run, and the number of intact slots
+  * that held wrong data (must be 0).
+  * The writer cycles over fanout_pool() numbered source blocks. The ring is a named one, which every
+  * reader opens by itself after the fork.
+  */
+void measure_fanout (const char * name, const Demux & demux, const Config & config)
+{
+    printf("      %-32s:", name);
     fflush(stdout);
-    unsigned iterations = ITERATIONS;
-    int64_t tfirst;
-
-    for (unsigned count = MIN_COUNT; count <= MAX_COUNT; count *= 2) {
-        uint64_t t0 = currentTimeMillis();
-        for (unsigned i = 0; i < iterations; i++) {
-            for (unsigned j = 0; j < count; j++) {
-                demux.demux(src, SRC_SIZE, dst + NUM_TIMESLOTS * j);
+    uint64_t budget = (uint64_t) config.budget_ms * 1000000;
+    size_t pool = fanout_pool (config.ring_slots);
+    char ring_name [32];
+    snprintf (ring_name, sizeof (ring_name), "/e1-ring.%d", (int) getpid ());
+    string losses, lagging, corrupt;
+    char buf [32];
+
+    // one counter per reader, a cache line apart, shared with the reader processes
+    uint64_t * mismatches = (uint64_t *) mmap (0, RING_MAX_READERS * RING_LINE, PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mismatches == MAP_FAILED) {
+        perror ("mmap");
+        exit (1);
+    }
+    static const size_t STRIDE = RING_LINE / sizeof (uint64_t);
+
+    for (size_t f = 0; f < config.num_fanout; f++) {
+        unsigned readers = config.fanout [f];
+        Shm_Ring ring (config.ring_slots, NUM_TIMESLOTS, DST_SIZE, ring_name);
+        if (! ring.valid ()) {
+            perror (ring_name);
+            exit (1);
+        }
+        memset (mismatches, 0, RING_MAX_READERS * RING_LINE);
+        pid_t parent = getpid ();
+        pid_t pids [RING_MAX_READERS];
+        for (unsigned r = 0; r < readers; r++) {
+            pid_t pid = fork ();
+            if (pid == 0) {
+                // don't outlive the writer if it dies
+                prctl (PR_SET_PDEATHSIG, SIGKILL);
+                if (getppid () != parent) _exit (1);
+                fanout_reader_process (ring_name, pool, mismatches);
             }
+            if (pid < 0) {
+                perror ("fork");
+                stop_readers (ring, pids, r);
+                exit (1);
+            }
+            pids [r] = pid;
         }
-        int64_t t = (int64_t)(currentTimeMillis() - t0);
-        if (count == MIN_COUNT) {
-            tfirst = t;
+        if (! wait_for_readers (ring, readers)) {
+            fprintf(stderr, "A fan-out reader failed to start\n");
+            stop_readers (ring, pids, readers);
+            exit (1);
         }
-        else {
-            t -= tfirst;
+
+        uint64_t elapsed = 0;
+        uint64_t blocks = 0;
+        unsigned max_lagging = 0;
+        size_t j = 0;
+        uint64_t t0 = currentTimeNanos();
+        while (elapsed < budget) {
+            for (unsigned i = 0; i < 1024; i++) {
+                demux.demux (src + SRC_SIZE * j, SRC_SIZE, ring.begin_write ());
+                ring.end_write ();
+                if (++ j == pool) j = 0;
+            }
+            blocks += 1024;
+            unsigned lag = ring.lagging_readers (config.ring_slots / 2);
+            if (lag && ring.reap_dead_readers ()) {
+                lag = ring.lagging_readers (config.ring_slots / 2);
+            }
+            if (lag > max_lagging) max_lagging = lag;
+            elapsed = currentTimeNanos() - t0;
+        }
+        stop_readers (ring, pids, readers);
+
+        uint64_t consumed = 0;
+        uint64_t lost = 0;
+        uint64_t bad = 0;
+        // the readers claimed records in any order, and the unused ones of a new ring are zero
+        for (unsigned r = 0; r < RING_MAX_READERS; r++) {
+            consumed += ring.reader_info (r).consumed;
+            lost += ring.reader_info (r).lost;
+            bad += mismatches [r * STRIDE];
         }
-        printf("%5d", t);
+        printf(" %6.1f", (double) elapsed / blocks);
         fflush(stdout);
-        iterations /= 2;
+        snprintf (buf, sizeof (buf), " %6.1f", consumed + lost ? lost * 100.0 / (consumed + lost) : 0.0);
+        losses += buf;
+        snprintf (buf, sizeof (buf), " %6u", max_lagging);
+        lagging += buf;
+        snprintf (buf, sizeof (buf), " %6llu", (unsigned long long) bad);
+        corrupt += buf;
     }
-    cout << endl;
+    munmap (mismatches, RING_MAX_READERS * RING_LINE);
+    printf("\n%-38s:%s\n", "      lost, %", losses.c_str());
+    printf("%-38s:%s\n", "      lagging readers, max", lagging.c_str());
+    printf("%-38s:%s\n", "      corrupt slots", corrupt.c_str());
 }
 
-void measure_rand(const Demux & demux)
+void print_instr (const Instr_Snapshot & before, const Instr_Snapshot & after)
 {
-    printf("rand  %-30s:", typeid (demux).name());
-    fflush(stdout);
-    unsigned iterations = ITERATIONS;
-    int64_t tfirst;
-    srand(0);
+    uint64_t calls = after.calls - before.calls;
+    uint64_t bytes = after.bytes - before.bytes;
+    uint64_t samples = after.samples - before.samples;
+    uint64_t cycles = after.sampled_cycles - before.sampled_cycles;
+    uint64_t sampled_bytes = after.sampled_bytes - before.sampled_bytes;
+    printf("instr calls=%llu blocks=%.1f bytes=%llu samples=%llu cycles/block=%.1f\n",
+           (unsigned long long) calls,
+           (double) bytes / SRC_SIZE,
+           (unsigned long long) bytes,
+           (unsigned long long) samples,
+           sampled_bytes ? (double) cycles * SRC_SIZE / sampled_bytes : 0.0);
+    if (! samples) return;
+    printf("instr cycles histogram:");
+    for (unsigned b = 0; b < INSTR_HIST_BUCKETS; b++) {
+        uint64_t n = after.hist [b] - before.hist [b];
+        if (n) printf(" %llu:%.1f%%", 1ULL << b, n * 100.0 / samples);
+    }
+    printf("\n");
+}
 
-    for (unsigned count = MIN_COUNT; count <= MAX_COUNT; count *= 2) {
-        uint64_t t0 = currentTimeMillis();
-        for (unsigned i = 0; i < iterations; i++) {
-            for (unsigned j = 0; j < count; j++) {
-                unsigned p = rand() & (count - 1);
-                demux.demux(src + SRC_SIZE * p, SRC_SIZE, dst + NUM_TIMESLOTS * p);
+void measure (const char * name, const Demux & demux, const Config & config)
+{
+#ifdef E1_INSTRUMENT
+    Instr_Snapshot before = instr_snapshot ();
+#endif
+    for (unsigned mode = 0; mode < NUM_MODES; mode++) {
+        if (config.modes [mode]) {
+            measure ((Mode) mode, name, demux, config);
+        }
+    }
+#ifdef E1_INSTRUMENT
+    print_instr (before, instr_snapshot ());
+#endif
+    printf("\n");
+}
+
+#ifdef E1_INSTRUMENT
+#define LINK(D) Instrumented<D>
+#else
+#define LINK(D) D
+#endif
+
+#define KERNEL(D, frame_multiple, is_transpose) { #D, new LINK (D) (), frame_multiple, is_transpose }
+
+struct Kernel
+{
+    const char * name;
+    const Demux * demux;
+    size_t frame_multiple;  // the kernel only accepts sources of a multiple of this many frames
+    bool is_transpose;      // false for copies, which are only timed as a reference
+};
+
+static const Kernel KERNELS [] = {
+    KERNEL (Src_First_1, DST_SIZE, true),
+    KERNEL (Dst_First_3a, DST_SIZE, true),
+    KERNEL (Write8, DST_SIZE, true),
+    KERNEL (Read8_Write16_SSE_Unroll, DST_SIZE, true),
+    KERNEL (Read8_Write32_AVX_Unroll, DST_SIZE, true),
+    KERNEL (Copy_AVX, DST_SIZE, false),
+};
+
+static const size_t NUM_KERNELS = sizeof (KERNELS) / sizeof (KERNELS [0]);
+
+/** Kernels for large windows. The Tiled ones only accept whole numbers of tiles (DST_SIZE frames).
+  */
+static const Kernel WINDOW_KERNELS [] = {
+    KERNEL (Transpose_Window, 1, true),
+    KERNEL (Src_First_1, 1, true),
+    KERNEL (Tiled<Dst_First_3a>, DST_SIZE, true),
+    KERNEL (Tiled<Write8>, DST_SIZE, true),
+    KERNEL (Tiled<Read8_Write16_SSE_Unroll>, DST_SIZE, true),
+    KERNEL (Tiled<Read8_Write32_AVX_Unroll>, DST_SIZE, true),
+    KERNEL (Tiled<Copy_AVX>, DST_SIZE, false),
+};
+
+static const size_t NUM_WINDOW_KERNELS = sizeof (WINDOW_KERNELS) / sizeof (WINDOW_KERNELS [0]);
+
+static_assert (NUM_KERNELS <= MAX_KERNELS && NUM_WINDOW_KERNELS <= MAX_KERNELS, "increase MAX_KERNELS");
+
+/** A large window: source of the given number of frames and one contiguous array per channel
+  */
+struct Window
+{
+    size_t frames;
+    byte * src;
+    byte * buf;
+    byte * dst [NUM_TIMESLOTS];
+
+    /** @param offset displacement of channel arrays from 32-byte alignment
+      */
+    explicit Window (size_t frames, size_t offset = 0) : frames (frames)
+    {
+        size_t stride = (frames + offset + 31) / 32 * 32;
+        src = (byte*)allocate(frames * NUM_TIMESLOTS);
+        buf = (byte*)allocate(stride * NUM_TIMESLOTS);
+        for (size_t i = 0; i < frames * NUM_TIMESLOTS; i++) {
+            src [i] = (byte) rand();
+        }
+        memset (buf, 0xDD, stride * NUM_TIMESLOTS);
+        for (size_t dst_num = 0; dst_num < NUM_TIMESLOTS; dst_num++) {
+            dst [dst_num] = buf + dst_num * stride + offset;
+        }
+    }
+
+    ~Window ()
+    {
+        _mm_free (src);
+        _mm_free (buf);
+    }
+
+    size_t src_length () const { return frames * NUM_TIMESLOTS; }
+};
+
+/** Checks all window transposes against Src_First_1 on a window of the given size
+  * @return false if some kernel produced different data
+  */
+bool check_window (size_t frames)
+{
+    Window ref (frames);
+    Src_First_1 ().demux (ref.src, ref.src_length (), ref.dst);
+
+    for (size_t i = 0; i < NUM_WINDOW_KERNELS; i++) {
+        const Kernel & k = WINDOW_KERNELS [i];
+        if (! k.is_transpose || frames % k.frame_multiple != 0 || typeid (*k.demux) == typeid (LINK (Src_First_1))) {
+            continue;
+        }
+        // the kernels that accept any number of frames also accept channel arrays that are not aligned
+        size_t offsets = k.frame_multiple == 1 ? 2 : 1;
+        for (size_t offset = 0; offset < offsets; offset++) {
+            Window w (frames, offset);
+            memcpy (w.src, ref.src, ref.src_length ());
+            k.demux->demux (w.src, w.src_length (), w.dst);
+            for (size_t dst_num = 0; dst_num < NUM_TIMESLOTS; dst_num++) {
+                if (memcmp (w.dst [dst_num], ref.dst [dst_num], frames) != 0) {
+                    fprintf(stderr, "Check failed: %s, %zu frames, offset %zu, channel %zu\n",
+                            k.name, frames, offset, dst_num);
+                    return false;
+                }
             }
         }
-        int64_t t = (int64_t)(currentTimeMillis() - t0);
-        if (count == MIN_COUNT) {
-            tfirst = t;
+    }
+    return true;
+}
+
+/** Measure one kernel on windows of all the requested sizes. Prints one line of average times
+  * per SRC_SIZE bytes of source, in nanoseconds, to be comparable with the small-block results.
+  */
+void measure_window (const Kernel & kernel, const Config & config)
+{
+    const Demux & demux = *kernel.demux;
+    printf("      %-32s:", kernel.name);
+    fflush(stdout);
+    uint64_t budget = (uint64_t) config.budget_ms * 1000000;
+
+    for (size_t i = 0; i < config.num_windows; i++) {
+        size_t frames = config.windows [i];
+        if (frames % kernel.frame_multiple != 0) {
+            printf(" %6s", "-");
+            continue;
         }
-        else {
-            t -= tfirst;
+        Window w (frames);
+        demux.demux (w.src, w.src_length (), w.dst);
+
+        uint64_t elapsed = 0;
+        uint64_t total_passes = 0;
+        unsigned passes = 1;
+        while (elapsed < budget) {
+            uint64_t t0 = currentTimeNanos();
+            for (unsigned i = 0; i < passes; i++) {
+                demux.demux (w.src, w.src_length (), w.dst);
+            }
+            uint64_t t = currentTimeNanos() - t0;
+            elapsed += t;
+            total_passes += passes;
+            if (t < budget / 8) passes *= 2;
         }
-        printf("%5d", t);
+        printf(" %6.1f", (double) elapsed * SRC_SIZE / (total_passes * w.src_length ()));
         fflush(stdout);
-        iterations /= 2;
     }
     cout << endl;
 }
 
-void measure(const Demux & demux)
+inline const char * item_name (const char * name) { return name; }
+inline const char * item_name (const Kernel & kernel) { return kernel.name; }
+
+/** Selects items by name from a comma-separated list
+  * @param list     the list, or 0 to select all items
+  * @param items    the items to choose from (mode names or kernels)
+  * @param count    the number of items
+  * @param selected receives, for every item, whether it is in the list
+  * @param what     the kind of items, for the error message
+  * @return false if the list contains a name that is not one of the items
+  */
+/** Parses a comma-separated list of numbers
+  * @param list   the list
+  * @param min    the smallest accepted number
+  * @param max    the largest accepted number
+  * @param values receives the numbers, up to MAX_POINTS of them
+  * @param count  receives the number of numbers
+  * @param what   the kind of list, for the error message
+  * @return false if the list is empty, too long, or not made of numbers in [min, max]
+  */
+bool parse_numbers (const char * list, size_t min, size_t max, size_t * values, size_t & count, const char * what)
 {
-    measure_base(demux);
-    measure_rand(demux);
-    printf("\n");
+    count = 0;
+    for (const char * p = list; count == 0 || *p; ) {
+        char * end;
+        unsigned long n = strtoul (p, &end, 0);
+        if (end == p || (*end && *end != ',') || n < min || n > max || count == MAX_POINTS) {
+            fprintf(stderr, "Invalid %s list %s\n", what, list);
+            return false;
+        }
+        values [count ++] = n;
+        p = *end ? end + 1 : end;
+    }
+    return true;
 }
 
-int main (void)
+template<class T> bool select_items (const char * list, const T * items, size_t count, bool * selected, const char * what)
 {
-    src = generate (MAX_COUNT);
-    dst = allocate_dst(MAX_COUNT);
+    for (size_t i = 0; i < count; i++) {
+        selected [i] = ! list;
+    }
+    for (const char * p = list; p && *p; ) {
+        size_t len = strcspn (p, ",");
+        size_t i = 0;
+        while (i < count && ! (strlen (item_name (items [i])) == len && strncmp (p, item_name (items [i]), len) == 0)) {
+            ++ i;
+        }
+        if (i == count) {
+            fprintf(stderr, "Unknown %s %.*s\n", what, (int) len, p);
+            return false;
+        }
+        selected [i] = true;
+        p += len;
+        if (*p) ++ p;
+    }
+    return true;
+}
 
-    printf("      %30s:", "");
-    for (size_t count = MIN_COUNT; count <= MAX_COUNT; count *= 2) {
+void usage (const char * prog)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "  -k kernels  comma-separated kernel names (default: all)\n"
+            "  -m modes    comma-separated access modes: base,rand,read,write,mixed (default: base,rand)\n"
+            "  -s count    smallest number of blocks in the sweep (default: 1)\n"
+            "  -e count    largest number of blocks in the sweep (default: 1048576)\n"
+            "  -x step     sweep step: a multiplier N, or an increment +N (default: 2)\n"
+            "  -t ms       time budget per point of the sweep, in milliseconds (default: 100)\n"
+            "  -f readers  run the shared-memory fan-out benchmark with the given comma-separated reader counts\n"
+            "  -r slots    number of slots in the fan-out ring (default: 256)\n"
+            "  -w frames   run the large-window benchmark with the given comma-separated window sizes, in frames\n"
+            "  -l          list kernels and exit\n"
+            "A block is %u bytes of source and as many of destination.\n"
+            "Results are nanoseconds per block.\n", prog, (unsigned) SRC_SIZE);
+}
+
+bool parse_args (int argc, char ** argv, Config & config)
+{
+    const char * modes = "base,rand";
+    const char * kernels = 0;
+    const char * fanout = 0;
+    const char * windows = 0;
+    int opt;
+    while ((opt = getopt (argc, argv, "k:m:s:e:x:t:f:r:w:lh")) != -1) {
+        switch (opt) {
+        case 'k': kernels = optarg; break;
+        case 'm': modes = optarg; break;
+        case 's': config.min_count = strtoul (optarg, 0, 0); break;
+        case 'e': config.max_count = strtoul (optarg, 0, 0); break;
+        case 'x':
+            config.step_add = optarg [0] == '+';
+            config.step = strtoul (optarg + config.step_add, 0, 0);
+            break;
+        case 't': config.budget_ms = strtoul (optarg, 0, 0); break;
+        case 'f': fanout = optarg; break;
+        case 'r': config.ring_slots = strtoul (optarg, 0, 0); break;
+        case 'w': windows = optarg; break;
+        case 'l':
+            printf("Small-block kernels:\n");
+            for (size_t i = 0; i < NUM_KERNELS; i++) printf("  %s\n", KERNELS [i].name);
+            printf("Large-window kernels (-w):\n");
+            for (size_t i = 0; i < NUM_WINDOW_KERNELS; i++) printf("  %s\n", WINDOW_KERNELS [i].name);
+            exit (0);
+        default:
+            usage (argv [0]);
+            return false;
+        }
+    }
+    if (optind != argc) {
+        usage (argv [0]);
+        return false;
+    }
+    if (config.min_count == 0 || config.max_count < config.min_count) {
+        fprintf(stderr, "Invalid sweep range %zu..%zu\n", config.min_count, config.max_count);
+        return false;
+    }
+    if (config.step_add ? config.step == 0 : config.step < 2) {
+        fprintf(stderr, "Invalid sweep step\n");
+        return false;
+    }
+    if (config.budget_ms == 0) {
+        fprintf(stderr, "Invalid time budget\n");
+        return false;
+    }
+    if (windows && ! parse_numbers (windows, 1, (size_t) -1, config.windows, config.num_windows, "window size")) {
+        return false;
+    }
+    if (fanout) {
+        if (! parse_numbers (fanout, 0, RING_MAX_READERS, config.fanout, config.num_fanout, "reader count")) {
+            return false;
+        }
+        if (config.ring_slots < 2) {
+            fprintf(stderr, "Invalid ring size\n");
+            return false;
+        }
+    }
+    if (! select_items (modes, MODE_NAMES, NUM_MODES, config.modes, "mode")) {
+        return false;
+    }
+    // only the kernels of the chosen benchmark are accepted
+    if (config.num_windows) {
+        return select_items (kernels, WINDOW_KERNELS, NUM_WINDOW_KERNELS, config.kernels, "large-window kernel");
+    }
+    return select_items (kernels, KERNELS, NUM_KERNELS, config.kernels, "small-block kernel");
+}
+
+int main (int argc, char ** argv)
+{
+    Config config;
+    if (! parse_args (argc, argv, config)) {
+        return 1;
+    }
+
+#ifdef E1_INSTRUMENT
+    const char * shm_name = getenv ("E1_INSTR_SHM");
+    if (shm_name && ! instr_export_shm (shm_name)) {
+        perror (shm_name);
+    }
+#endif
+
+    if (config.num_windows) {
+        static const size_t EDGE_FRAMES [] = {1, 31, 33, 100, DST_SIZE * 3};
+        for (size_t i = 0; i < sizeof (EDGE_FRAMES) / sizeof (EDGE_FRAMES [0]); i++) {
+            if (! check_window (EDGE_FRAMES [i])) return 1;
+        }
+        printf("      %-32s:", "frames");
+        for (size_t i = 0; i < config.num_windows; i++) {
+            if (! check_window (config.windows [i])) return 1;
+            printf(" %6zu", config.windows [i]);
+        }
+        printf("\n");
+        for (size_t i = 0; i < NUM_WINDOW_KERNELS; i++) {
+            if (config.kernels [i]) {
+                measure_window (WINDOW_KERNELS [i], config);
+            }
+        }
+        return 0;
+    }
+
+    if (config.num_fanout) {
+        // the fan-out source pool does not depend on the sweep range
+        size_t pool = fanout_pool (config.ring_slots);
+        for (size_t k = 0; k < pool; k++) {
+            // a slot's next occupant must hold other bytes, or torn slots would pass the corrupt-slot check
+            assert ((byte) k != (byte) ((k + config.ring_slots) % pool));
+        }
+        src = generate_numbered (pool);
+        printf("      %-32s:", "readers");
+        for (size_t f = 0; f < config.num_fanout; f++) {
+            printf(" %6zu", config.fanout [f]);
+        }
+        printf("\n");
+        for (size_t i = 0; i < NUM_KERNELS; i++) {
+            if (config.kernels [i]) {
+                measure_fanout (KERNELS [i].name, *KERNELS [i].demux, config);
+            }
+        }
+        return 0;
+    }
+
+    // buffers are sized to the largest point of the sweep
+    src = generate (config.max_count);
+    dst = allocate_dst(config.max_count);
+    rnd_raw = (unsigned*)allocate(config.max_count * sizeof (unsigned));
+    rnd = (unsigned*)allocate(config.max_count * sizeof (unsigned));
+    srand(0);
+    for (size_t i = 0; i < config.max_count; i++) {
+        rnd_raw [i] = rand();
+    }
+
+    printf("      %32s:", "");
+    for (size_t count = config.min_count; count <= config.max_count; count = config.next (count)) {
         size_t size = count * SRC_SIZE * 2;
         char c = ' ';
         if (size >= 1024 * 1024 * 1024) {
@@ -416,16 +1193,15 @@ int main (void)
             size /= 1024;
             c = 'k';
         }
-        printf(" %3d%c", size, c);
+        printf(" %5zu%c", size, c);
     }
     printf("\n");
 
-    measure (Src_First_1 ());
-    measure (Dst_First_3a ());
-    measure (Write8 ());
-    measure (Read8_Write16_SSE_Unroll ());
-    measure (Read8_Write32_AVX_Unroll ());
-    measure (Copy_AVX ());
+    for (size_t i = 0; i < NUM_KERNELS; i++) {
+        if (config.kernels [i]) {
+            measure (KERNELS [i].name, *KERNELS [i].demux, config);
+        }
+    }
 
     return 0;
 }
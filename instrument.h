@@ -0,0 +1,264 @@
+#include <stdint.h>
+#include <string.h>
+#include <x86intrin.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/** Low-overhead hot-path instrumentation for demux calls.
+  *
+  * Every thread that calls instr_end() claims its own counter slot in a global table. A slot is padded to
+  * a whole number of cache lines, so threads never share a line and the hot path has no locked instructions:
+  * the owner thread is the only writer, and it publishes values with plain (relaxed atomic) stores.
+  * A reader (this process via instr_snapshot(), or another process that maps the shared-memory table)
+  * collects the counters with relaxed atomic loads, without taking any locks. The values of the different
+  * counters are therefore not guaranteed to be mutually consistent, but each one is never torn.
+  *
+  * Counting calls, blocks and bytes costs three stores per call. Time is only measured on one call out of
+  * INSTR_SAMPLE_PERIOD (per thread), using RDTSC; sampled calls also feed a log2 latency histogram.
+  *
+  * The whole layer is compiled out unless E1_INSTRUMENT is defined: without it, instr_begin() returns 0
+  * and instr_end() is an empty inline function.
+  */
+
+#ifndef INSTR_SAMPLE_PERIOD
+#define INSTR_SAMPLE_PERIOD 64             // must be a power of two
+#endif
+
+static const unsigned INSTR_MAX_THREADS = 64;
+static const unsigned INSTR_HIST_BUCKETS = 32; // bucket i counts samples of [2^i, 2^(i+1)) cycles
+static const uint32_t INSTR_MAGIC = 0x45314931; // "1I1E"
+static const size_t   CACHE_LINE = 64;
+
+/** Per-thread counters. Only the owner thread writes them.
+  */
+struct Instr_Slot
+{
+    uint64_t calls;             // number of instrumented calls
+    uint64_t bytes;             // number of source bytes processed
+    uint64_t samples;           // number of calls that were timed
+    uint64_t sampled_cycles;    // total TSC cycles of the timed calls
+    uint64_t sampled_bytes;     // total source bytes of the timed calls
+    uint64_t hist [INSTR_HIST_BUCKETS];
+} __attribute__ ((aligned (CACHE_LINE)));
+
+/** The table that holds all slots. Its layout is the export format: an external reader that maps the
+  * shared-memory segment (see instr_export_shm) sees exactly this structure. Readers only accept a table
+  * whose magic, slot_size and max_threads match their own build (see instr_table_valid).
+  */
+struct Instr_Table
+{
+    uint32_t magic;
+    uint32_t slot_size;
+    uint32_t max_threads;
+    uint32_t sample_period;
+    uint32_t threads;           // number of claimed slots
+    Instr_Slot slots [INSTR_MAX_THREADS];
+} __attribute__ ((aligned (CACHE_LINE)));
+
+/** Sum of all per-thread counters at some moment
+  */
+struct Instr_Snapshot
+{
+    unsigned threads;
+    unsigned sample_period;     // one call out of sample_period is timed
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t samples;
+    uint64_t sampled_cycles;
+    uint64_t sampled_bytes;
+    uint64_t hist [INSTR_HIST_BUCKETS];
+
+    /** Blocks are derived from bytes, so calls on partial blocks are counted correctly
+      * @param block_size size of a block in bytes
+      * @return number of blocks processed
+      */
+    double blocks (size_t block_size) const
+    {
+        return (double) bytes / block_size;
+    }
+
+    /** @param block_size size of a block in bytes
+      * @return average number of TSC cycles per block over the sampled calls, or 0 if nothing was sampled
+      */
+    double cycles_per_block (size_t block_size) const
+    {
+        return sampled_bytes ? (double) sampled_cycles * block_size / sampled_bytes : 0;
+    }
+};
+
+static Instr_Table instr_static_table;
+static Instr_Table * instr_table = &instr_static_table;
+
+static __thread Instr_Slot * instr_slot;       // this thread's slot, claimed on first use
+
+/** Relaxed store of a counter that has only one writer. Compiles to a plain MOV.
+  */
+inline void instr_bump (uint64_t & counter, uint64_t delta)
+{
+    __atomic_store_n (&counter, __atomic_load_n (&counter, __ATOMIC_RELAXED) + delta, __ATOMIC_RELAXED);
+}
+
+/** Initialise the table header
+  */
+inline void instr_init_table (Instr_Table * table)
+{
+    table->slot_size = sizeof (Instr_Slot);
+    table->max_threads = INSTR_MAX_THREADS;
+    table->sample_period = INSTR_SAMPLE_PERIOD;
+    __atomic_store_n (&table->magic, INSTR_MAGIC, __ATOMIC_RELEASE);
+}
+
+/** Checks that a table is initialised and has the layout of this build
+  */
+inline bool instr_table_valid (const Instr_Table * table)
+{
+    return __atomic_load_n (&table->magic, __ATOMIC_ACQUIRE) == INSTR_MAGIC
+        && table->slot_size == sizeof (Instr_Slot)
+        && table->max_threads == INSTR_MAX_THREADS;
+}
+
+/** Claim a slot for the calling thread. Threads beyond INSTR_MAX_THREADS share the last slot
+  * (their counts become approximate, but remain cheap and safe to read).
+  */
+inline Instr_Slot * instr_claim_slot ()
+{
+    if (__atomic_load_n (&instr_table->magic, __ATOMIC_ACQUIRE) != INSTR_MAGIC) {
+        instr_init_table (instr_table);
+    }
+    unsigned n = __atomic_fetch_add (&instr_table->threads, 1, __ATOMIC_RELAXED);
+    if (n >= INSTR_MAX_THREADS) n = INSTR_MAX_THREADS - 1;
+    instr_slot = &instr_table->slots [n];
+    return instr_slot;
+}
+
+/** Number of the histogram bucket for the given cycle count
+  */
+inline unsigned instr_bucket (uint64_t cycles)
+{
+    unsigned b = cycles ? 63 - __builtin_clzll (cycles) : 0;
+    return b < INSTR_HIST_BUCKETS ? b : INSTR_HIST_BUCKETS - 1;
+}
+
+#ifdef E1_INSTRUMENT
+
+static __thread unsigned instr_counter;        // sampling counter of this thread
+
+/** Must be called before the instrumented operation.
+  * @return TSC value if this call is sampled, 0 otherwise
+  */
+inline uint64_t instr_begin ()
+{
+    if ((++ instr_counter & (INSTR_SAMPLE_PERIOD - 1)) != 0) return 0;
+    return __rdtsc ();
+}
+
+/** Must be called after the instrumented operation.
+  * @param t0     the value returned by instr_begin()
+  * @param bytes  number of source bytes processed
+  */
+inline void instr_end (uint64_t t0, uint64_t bytes)
+{
+    Instr_Slot * s = instr_slot;
+    if (__builtin_expect (! s, 0)) s = instr_claim_slot ();
+    instr_bump (s->calls, 1);
+    instr_bump (s->bytes, bytes);
+    if (t0) {
+        uint64_t cycles = __rdtsc () - t0;
+        instr_bump (s->samples, 1);
+        instr_bump (s->sampled_cycles, cycles);
+        instr_bump (s->sampled_bytes, bytes);
+        instr_bump (s->hist [instr_bucket (cycles)], 1);
+    }
+}
+
+#else
+
+inline uint64_t instr_begin () { return 0; }
+inline void instr_end (uint64_t, uint64_t) {}
+
+#endif
+
+/** Collect the counters of all threads. Lock-free; may be called from any thread at any time.
+  * @param table the table to read (the local one by default, or one mapped from another process)
+  */
+inline Instr_Snapshot instr_snapshot (const Instr_Table * table = instr_table)
+{
+    Instr_Snapshot r;
+    memset (&r, 0, sizeof (r));
+    if (! instr_table_valid (table)) return r;
+
+    unsigned n = __atomic_load_n (&table->threads, __ATOMIC_RELAXED);
+    r.threads = n;
+    r.sample_period = table->sample_period;
+    if (n > INSTR_MAX_THREADS) n = INSTR_MAX_THREADS;
+    for (unsigned i = 0; i < n; i++) {
+        const Instr_Slot & s = table->slots [i];
+        r.calls += __atomic_load_n (&s.calls, __ATOMIC_RELAXED);
+        r.bytes += __atomic_load_n (&s.bytes, __ATOMIC_RELAXED);
+        r.samples += __atomic_load_n (&s.samples, __ATOMIC_RELAXED);
+        r.sampled_cycles += __atomic_load_n (&s.sampled_cycles, __ATOMIC_RELAXED);
+        r.sampled_bytes += __atomic_load_n (&s.sampled_bytes, __ATOMIC_RELAXED);
+        for (unsigned b = 0; b < INSTR_HIST_BUCKETS; b++) {
+            r.hist [b] += __atomic_load_n (&s.hist [b], __ATOMIC_RELAXED);
+        }
+    }
+    return r;
+}
+
+#ifdef __linux__
+
+/** Move the counter table into a POSIX shared-memory segment, so that an external process can read it
+  * with instr_attach_shm() and instr_snapshot(). Must be called before any instrumented call is made.
+  * @param name shared memory object name, such as "/e1-instr"
+  * @return true on success; on failure the local table stays in use
+  */
+inline bool instr_export_shm (const char * name)
+{
+    int fd = shm_open (name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) return false;
+    if (ftruncate (fd, sizeof (Instr_Table)) != 0) {
+        close (fd);
+        return false;
+    }
+    void * p = mmap (0, sizeof (Instr_Table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if (p == MAP_FAILED) return false;
+    Instr_Table * table = (Instr_Table *) p;
+    memset (table, 0, sizeof (Instr_Table));
+    instr_init_table (table);
+    instr_table = table;
+    return true;
+}
+
+/** Map, read-only, a counter table exported by another process.
+  * Fails if the segment is smaller than a table (the writer has not sized it yet, or it is stale),
+  * if the writer has not initialised it yet, or if its layout differs from this build; the caller may retry.
+  * @param name shared memory object name passed to instr_export_shm() by the writer
+  * @return the table, or 0 on failure
+  */
+inline const Instr_Table * instr_attach_shm (const char * name)
+{
+    int fd = shm_open (name, O_RDONLY, 0);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat (fd, &st) != 0 || (size_t) st.st_size < sizeof (Instr_Table)) {
+        close (fd);
+        return 0;
+    }
+    void * p = mmap (0, sizeof (Instr_Table), PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (p == MAP_FAILED) return 0;
+    const Instr_Table * table = (const Instr_Table *) p;
+    if (! instr_table_valid (table)) {
+        munmap (p, sizeof (Instr_Table));
+        return 0;
+    }
+    return table;
+}
+
+#endif
@@ -0,0 +1,361 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/** A ring of demux destination slots in shared memory: one writer (the demuxer), many readers (consumer
+  * processes on the same host), no locks and no copies.
+  *
+  * Every slot contains the channel buffers for one demux call: channel c of a slot is a contiguous array of
+  * channel_size bytes, so the writer passes the slot's channel pointers directly as dst to Demux::demux,
+  * and the readers process the data in place.
+  *
+  * Position tracking uses sequence numbers. The n-th write (n = 0, 1, ...) goes to slot n % slot_count.
+  * Each slot carries a seqlock-style sequence: 2n+1 while write n is in progress, 2n+2 when it is complete.
+  * The header's published counter is the number of completed writes. A reader that wants write n checks
+  * that the slot sequence is 2n+2 before and after using the data; if it is not, the writer has lapped the
+  * reader, the data is lost for it, and the reader skips forward. The writer never waits for readers.
+  *
+  * Readers also report their position and loss count in per-reader, cache-line padded records in the
+  * header, so that lagging readers can be detected by the writer or by a monitor without any coordination.
+  * A reader process takes a free record with claim_reader(), which stores its pid there with an atomic
+  * compare-and-swap; records of readers that died without detaching are freed by reap_dead_readers().
+  *
+  * Linux only (memfd_create / shm_open).
+  */
+
+static const uint32_t RING_MAGIC = 0x45315247; // "GR1E"
+static const unsigned RING_MAX_READERS = 64;
+static const size_t RING_LINE = 64;
+
+/** Per-reader record. Only the owning reader writes it.
+  */
+struct Ring_Reader_Info
+{
+    uint64_t pos;           // next sequence number the reader wants
+    uint64_t consumed;      // number of slots processed successfully
+    uint64_t lost;          // number of slots overwritten before the reader could process them
+    uint32_t active;        // the record is initialised and in use
+    int32_t owner;          // pid of the reader process, 0 if the record is free
+} __attribute__ ((aligned (RING_LINE)));
+
+struct Ring_Slot_Header
+{
+    uint64_t seq;
+} __attribute__ ((aligned (RING_LINE)));
+
+struct Ring_Header
+{
+    uint32_t magic;
+    uint32_t slot_count;
+    uint32_t channels;
+    uint32_t channel_size;
+    uint64_t slot_size;     // slot header plus data, a multiple of RING_LINE
+    uint32_t done;          // set by the writer to tell readers to stop
+
+    uint64_t published __attribute__ ((aligned (RING_LINE))); // number of completed writes
+    Ring_Reader_Info readers [RING_MAX_READERS];
+} __attribute__ ((aligned (RING_LINE)));
+
+class Shm_Ring
+{
+public:
+    /** Create a new ring.
+      * @param slot_count   number of slots
+      * @param channels     number of channels (dst pointers) per slot
+      * @param channel_size size of each channel buffer, in bytes
+      * @param name         POSIX shared memory name for unrelated processes to open, or 0 for an anonymous memfd
+      *                     (which is shared with forked children, or passed by file descriptor).
+      *                     An existing object of that name is unlinked first, so that processes that still map it
+      *                     are not disturbed; the name is unlinked again when the creator destroys the ring.
+      * Check valid() after construction.
+      */
+    Shm_Ring (unsigned slot_count, unsigned channels, size_t channel_size, const char * name = 0)
+        : header (0), map_size (0), dst (0), write_seq (0), write_slot (0), owned_name (0)
+    {
+        size_t slot_size = round_up (sizeof (Ring_Slot_Header) + channels * round_up (channel_size, 32), RING_LINE);
+        size_t size = sizeof (Ring_Header) + slot_count * slot_size;
+        int fd;
+        if (name) {
+            shm_unlink (name);
+            fd = shm_open (name, O_CREAT | O_EXCL | O_RDWR, 0644);
+            if (fd >= 0) owned_name = strdup (name);
+        } else {
+            fd = (int) syscall (SYS_memfd_create, "e1-ring", 0);
+        }
+        if (fd < 0) return;
+        if (ftruncate (fd, size) == 0) {
+            map (fd, size);
+        }
+        close (fd);
+        if (! header) return;
+
+        // the object is new (a memfd, or created with O_EXCL), so ftruncate has zeroed it and nobody else maps it yet
+        header->slot_count = slot_count;
+        header->channels = channels;
+        header->channel_size = channel_size;
+        header->slot_size = slot_size;
+        __atomic_store_n (&header->magic, RING_MAGIC, __ATOMIC_RELEASE);
+        make_dst ();
+    }
+
+    /** Open an existing named ring (created by another process).
+      * Fails (valid() is false) if the creator has not finished initialising the ring, or if the segment
+      * is smaller than its header says; the caller may retry.
+      * @param name POSIX shared memory name given to the creator
+      */
+    explicit Shm_Ring (const char * name)
+        : header (0), map_size (0), dst (0), write_seq (0), write_slot (0), owned_name (0)
+    {
+        int fd = shm_open (name, O_RDWR, 0);
+        if (fd < 0) return;
+        struct stat st;
+        Ring_Header h;
+        if (fstat (fd, &st) == 0 && (size_t) st.st_size >= sizeof (h)
+            && pread (fd, &h, sizeof (h), 0) == (ssize_t) sizeof (h) && h.magic == RING_MAGIC
+            && h.slot_count != 0 && h.slot_size >= sizeof (Ring_Slot_Header) + (uint64_t) h.channels * h.channel_size) {
+            size_t size = sizeof (Ring_Header) + h.slot_count * h.slot_size;
+            if ((size_t) st.st_size >= size) {
+                map (fd, size);
+            }
+        }
+        close (fd);
+        if (! header) return;
+        make_dst ();
+        write_seq = __atomic_load_n (&header->published, __ATOMIC_ACQUIRE);
+        write_slot = (unsigned) (write_seq % header->slot_count);
+    }
+
+    ~Shm_Ring ()
+    {
+        if (header) munmap (header, map_size);
+        delete[] dst;
+        if (owned_name) {
+            shm_unlink (owned_name);
+            free (owned_name);
+        }
+    }
+
+    bool valid () const { return header != 0; }
+    unsigned slot_count () const { return header->slot_count; }
+
+    // ------ writer side
+
+    /** Start the next write.
+      * @return the channel pointers of the slot to pass as dst to Demux::demux
+      */
+    unsigned char ** begin_write ()
+    {
+        __atomic_store_n (&slot (write_slot)->seq, 2 * write_seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence (__ATOMIC_RELEASE);   // odd sequence becomes visible before any data
+        return dst + (size_t) write_slot * header->channels;
+    }
+
+    /** Publish the slot returned by the last begin_write()
+      */
+    void end_write ()
+    {
+        __atomic_store_n (&slot (write_slot)->seq, 2 * write_seq + 2, __ATOMIC_RELEASE);
+        __atomic_store_n (&header->published, ++ write_seq, __ATOMIC_RELEASE);
+        if (++ write_slot == header->slot_count) write_slot = 0;
+    }
+
+    /** Tell readers to stop
+      */
+    void finish ()
+    {
+        __atomic_store_n (&header->done, 1, __ATOMIC_RELEASE);
+    }
+
+    /** Count readers that are more than the given number of slots behind the writer.
+      * Readers that lag by slot_count - 1 or more are about to lose data.
+      */
+    unsigned lagging_readers (uint64_t max_lag) const
+    {
+        unsigned result = 0;
+        for (unsigned r = 0; r < RING_MAX_READERS; r++) {
+            const Ring_Reader_Info & info = header->readers [r];
+            if (! __atomic_load_n (&info.active, __ATOMIC_ACQUIRE)) continue;
+            // load pos before published: published only grows and a reader never passes it, so pos <= published;
+            // the clamp only guards against a record that claim_reader() is re-initialising
+            uint64_t pos = __atomic_load_n (&info.pos, __ATOMIC_ACQUIRE);
+            uint64_t published = __atomic_load_n (&header->published, __ATOMIC_ACQUIRE);
+            if (published > pos && published - pos > max_lag) {
+                ++ result;
+            }
+        }
+        return result;
+    }
+
+    /** Count readers that have claimed a record and are reading
+      */
+    unsigned active_readers () const
+    {
+        unsigned result = 0;
+        for (unsigned r = 0; r < RING_MAX_READERS; r++) {
+            result += __atomic_load_n (&header->readers [r].active, __ATOMIC_ACQUIRE) != 0;
+        }
+        return result;
+    }
+
+    /** Free the records of readers whose processes no longer exist (they crashed or exited
+      * without detach_reader), so that they are not reported as lagging forever.
+      * @return the number of records freed
+      */
+    unsigned reap_dead_readers ()
+    {
+        unsigned result = 0;
+        for (unsigned r = 0; r < RING_MAX_READERS; r++) {
+            Ring_Reader_Info & info = header->readers [r];
+            int32_t owner = __atomic_load_n (&info.owner, __ATOMIC_ACQUIRE);
+            if (owner != 0 && kill (owner, 0) != 0 && errno == ESRCH) {
+                __atomic_store_n (&info.active, 0, __ATOMIC_RELEASE);
+                if (__atomic_compare_exchange_n (&info.owner, &owner, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                    ++ result;
+                }
+            }
+        }
+        return result;
+    }
+
+    const Ring_Reader_Info & reader_info (unsigned r) const
+    {
+        return header->readers [r];
+    }
+
+    // ------ reader side
+
+    /** Take a free reader record for the calling process, starting from the current write position
+      * @return the reader number to pass to the other reader calls, or -1 if all records are taken
+      */
+    int claim_reader ()
+    {
+        int32_t pid = (int32_t) getpid ();
+        for (unsigned r = 0; r < RING_MAX_READERS; r++) {
+            Ring_Reader_Info & info = header->readers [r];
+            int32_t free_owner = 0;
+            if (__atomic_compare_exchange_n (&info.owner, &free_owner, pid, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                info.consumed = 0;
+                info.lost = 0;
+                info.pos = __atomic_load_n (&header->published, __ATOMIC_ACQUIRE);
+                __atomic_store_n (&info.active, 1, __ATOMIC_RELEASE);
+                return (int) r;
+            }
+        }
+        return -1;
+    }
+
+    /** Stop reading and free the record; its counters stay readable until the record is claimed again
+      */
+    void detach_reader (unsigned r)
+    {
+        __atomic_store_n (&header->readers [r].active, 0, __ATOMIC_RELEASE);
+        __atomic_store_n (&header->readers [r].owner, 0, __ATOMIC_RELEASE);
+    }
+
+    bool finished () const
+    {
+        return __atomic_load_n (&header->done, __ATOMIC_ACQUIRE) != 0;
+    }
+
+    /** Get the next slot for reader r, without waiting.
+      * If the writer has overrun the reader, the reader skips to the oldest slot that is still intact,
+      * and the skipped slots are counted as lost.
+      * @return the channel pointers of the slot, valid until end_read(), or 0 if there is no new data
+      */
+    const unsigned char * const * begin_read (unsigned r)
+    {
+        Ring_Reader_Info & info = header->readers [r];
+        uint64_t published = __atomic_load_n (&header->published, __ATOMIC_ACQUIRE);
+        uint64_t pos = info.pos;
+        if (pos >= published) return 0;
+
+        // the slot of write number 'published' may be being written now, so
+        // only the last slot_count - 1 writes are safe to start reading
+        uint64_t oldest = published - header->slot_count + 1;
+        if (published >= header->slot_count && pos < oldest) {
+            skip (info, oldest - pos);
+            pos = oldest;
+        }
+        unsigned i = (unsigned) (pos % header->slot_count);
+        if (__atomic_load_n (&slot (i)->seq, __ATOMIC_ACQUIRE) != 2 * pos + 2) {
+            skip (info, 1);
+            return 0;
+        }
+        return dst + (size_t) i * header->channels;
+    }
+
+    /** Finish reading the slot returned by begin_read().
+      * @return true if the data was intact during the whole read, false if the writer has overwritten it
+      * (in which case the results computed from it must be discarded)
+      */
+    bool end_read (unsigned r)
+    {
+        Ring_Reader_Info & info = header->readers [r];
+        uint64_t pos = info.pos;
+        unsigned i = (unsigned) (pos % header->slot_count);
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);   // all data reads complete before the sequence re-check
+        bool intact = __atomic_load_n (&slot (i)->seq, __ATOMIC_RELAXED) == 2 * pos + 2;
+        if (intact) {
+            __atomic_store_n (&info.consumed, info.consumed + 1, __ATOMIC_RELAXED);
+            __atomic_store_n (&info.pos, pos + 1, __ATOMIC_RELEASE);
+        } else {
+            skip (info, 1);
+        }
+        return intact;
+    }
+
+private:
+    Ring_Header * header;
+    size_t map_size;
+    unsigned char ** dst;    // channel pointers of all slots, in this process' address space
+    uint64_t write_seq;      // writer only: number of the next write (equals published)
+    unsigned write_slot;     // writer only: write_seq % slot_count, kept to avoid a division per write
+    char * owned_name;       // name of a named ring created by this object, unlinked on destruction
+
+    static size_t round_up (size_t x, size_t a)
+    {
+        return (x + a - 1) / a * a;
+    }
+
+    void map (int fd, size_t size)
+    {
+        void * p = mmap (0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) return;
+        header = (Ring_Header *) p;
+        map_size = size;
+    }
+
+    Ring_Slot_Header * slot (unsigned i) const
+    {
+        return (Ring_Slot_Header *) ((unsigned char *) header + sizeof (Ring_Header) + i * header->slot_size);
+    }
+
+    void make_dst ()
+    {
+        size_t stride = round_up (header->channel_size, 32);
+        dst = new unsigned char * [(size_t) header->slot_count * header->channels];
+        for (unsigned i = 0; i < header->slot_count; i++) {
+            unsigned char * data = (unsigned char *) (slot (i) + 1);
+            for (unsigned c = 0; c < header->channels; c++) {
+                dst [(size_t) i * header->channels + c] = data + c * stride;
+            }
+        }
+    }
+
+    void skip (Ring_Reader_Info & info, uint64_t n)
+    {
+        __atomic_store_n (&info.lost, info.lost + n, __ATOMIC_RELAXED);
+        __atomic_store_n (&info.pos, info.pos + n, __ATOMIC_RELEASE);
+    }
+
+    Shm_Ring (const Shm_Ring &);
+    void operator= (const Shm_Ring &);
+};
@@ -45,6 +45,16 @@ inline void _256i_store (unsigned char * p, __m256i x)
     _mm256_store_si256 ( (__m256i *) p, x);
 }
 
+/** Store 256-bit integer value to the unsigned char pointer that may be not aligned
+  * @param p  a pointer to write 256 bits to
+  * @param x  a 256-bit integer value to write
+  * This is just a convenience routine that takes away pointer cast from the user code.
+  */
+inline void _256i_storeu (unsigned char * p, __m256i x)
+{
+    _mm256_storeu_si256 ( (__m256i *) p, x);
+}
+
 /** Combine together two fields of 4 bits each, in lower to high order.
   * Used in permute2f128
   * @param n0 constant integer value of size 4 bits (not checked)
@@ -1,33 +1,13 @@
 #include <stdint.h>
-
-#ifdef __linux__
 #include <ctime>
-#else
-#ifndef _WIN32
-#include <sys/time.h>
-#endif
-#endif
 
-#ifdef _WIN32
-#include <Windows.h>
+#ifndef __linux__
+#error Only Linux is supported
 #endif
 
-static uint64_t currentTimeMillis()
+static uint64_t currentTimeNanos()
 {
-#ifdef _WIN32
-    const uint64_t EPOCH = 116444736000000000;
-
-    FILETIME fileTime;
-    GetSystemTimeAsFileTime (&fileTime);
-    uint64_t t = * (uint64_t*) &fileTime;
-    return (t-EPOCH) / 10000;
-#else
-#ifdef __linux__
     timespec tse;
-    clock_gettime(CLOCK_REALTIME, &tse);
-    return (tse.tv_sec * 1000 + tse.tv_nsec * 1E-6);
-#else
-#error Only Linux and Win32 are supported
-#endif
-#endif
+    clock_gettime(CLOCK_MONOTONIC, &tse);
+    return (uint64_t) tse.tv_sec * 1000000000 + tse.tv_nsec;
 }